@@ -1,4 +1,6 @@
 #include "xml.h"
+#include <functional>
+#include <thread>
 
 using namespace std;
 
@@ -102,6 +104,185 @@ void test_split()
     ));
 }
 
+// unit testing for xml::Parser
+void test_parser()
+{
+    unittest("Parser: matches load()", [] {
+        xml::Element expect;
+        xml::load("test/note.xml", expect);
+
+        xml::Parser parser;
+        auto& doc = parser.load("test/note.xml");
+        xml::Element actual;
+        doc.to_element(doc.root(), actual);
+
+        assert_equal(expect.children[0].tag, actual.tag);
+        assert_equal(expect.children[0].children.size(), actual.children.size());
+        assert_equal(expect.children[0].children[1].attributes.size(), actual.children[1].attributes.size());
+        assert_equal(expect.children[0].children[1].attributes["bang"], actual.children[1].attributes["bang"]);
+        assert_equal(expect.children[0].children[4].text, actual.children[4].text);
+    });
+
+    unittest("Parser: reuse across loads", [] {
+        xml::Parser parser;
+        parser.load("test/cd.xml");
+        auto& doc = parser.load("test/note.xml");
+        assert_equal(string("note"), doc.str(doc.node(doc.root()).tag));
+
+        string value;
+        auto to = doc.node(doc.node(doc.root()).first_child).next_sibling;
+        assert_equal(true, doc.find_attribute(to, "fibble", value));
+        assert_equal(string("wibble"), value);
+    });
+
+    unittest("Parser: failed load leaves an empty document", [] {
+        xml::Parser parser;
+        parser.load("test/note.xml");
+        try
+        {
+            parser.parse("<r><a></r");
+        }
+        catch (const exception&)
+        {
+        }
+        assert_equal(true, parser.document().empty());
+    });
+}
+
+// unit testing for LoadOptions::filter
+void test_filter()
+{
+    unittest("filter: include_tags", [] {
+        xml::LoadOptions options;
+        options.filter = xml::include_tags({"to", "body"});
+        xml::Element document;
+        xml::load("test/note.xml", document, options);
+
+        auto& note = document.children[0];
+        assert_equal(size_t(2), note.children.size());
+        assert_equal(string("to"), note.children[0].tag);
+        assert_equal(string("body"), note.children[1].tag);
+        assert_equal(size_t(2), note.children[1].children.size());
+    });
+
+    unittest("filter: exclude_tags", [] {
+        xml::LoadOptions options;
+        options.filter = xml::exclude_tags({"body", "selfclosed"});
+        xml::Parser parser;
+        auto& doc = parser.load("test/note.xml", options);
+        assert_equal(size_t(4), doc.size());
+    });
+
+    unittest("filter: include_paths", [] {
+        xml::LoadOptions options;
+        options.filter = xml::include_paths({"note/body/body"});
+        xml::Parser parser;
+        auto& doc = parser.load("test/note.xml", options);
+
+        // note, body, body, i
+        assert_equal(size_t(4), doc.size());
+        assert_equal(string("i"), doc.str(doc.node(3).tag));
+    });
+
+    unittest("filter: comment before filtered element", [] {
+        xml::LoadOptions options;
+        options.filter = xml::include_tags({"a"});
+        xml::Parser parser;
+        auto& doc = parser.parse("<r><!-- c --><a/><b/></r>", options);
+        assert_equal(size_t(2), doc.size());
+        assert_equal(string("a"), doc.str(doc.node(1).tag));
+    });
+
+    unittest("filter: comment after filtered element", [] {
+        xml::LoadOptions options;
+        options.filter = xml::include_tags({"a"});
+        xml::Parser parser;
+        auto& doc = parser.parse("<r><a/><!-- c --></r>", options);
+        assert_equal(size_t(2), doc.size());
+    });
+
+    unittest("filter: processing instruction and CDATA", [] {
+        xml::LoadOptions options;
+        options.filter = xml::exclude_tags({"b"});
+        xml::Parser parser;
+        auto& doc = parser.parse("<!-- x --><r><?pi x?><a/><b><![CDATA[</b>]]></b><![CDATA[<t>]]></r>", options);
+        assert_equal(size_t(2), doc.size());
+        assert_equal(string("a"), doc.str(doc.node(1).tag));
+        assert_equal(string("<t>"), doc.str(doc.text(doc.node(0).first_text).text));
+    });
+}
+
+// unit testing for the Document indexes
+void test_index()
+{
+    unittest("index: children by tag", [] {
+        xml::Parser parser;
+        auto& doc = parser.load("test/cd.xml");
+        auto cds = doc.children(doc.root(), "CD");
+        assert_equal(size_t(26), cds.size());
+
+        auto titles = doc.children(*cds.begin(), "TITLE");
+        assert_equal(size_t(1), titles.size());
+        assert_equal(string("Empire Burlesque"), doc.str(doc.text(doc.node(*titles.begin()).first_text).text));
+        assert_equal(true, doc.children(doc.root(), "DVD").empty());
+    });
+
+    unittest("index: nodes by attribute", [] {
+        xml::Parser parser;
+        auto& doc = parser.load("test/note.xml");
+        auto nodes = doc.find_by_attribute("foo", "bar");
+        assert_equal(size_t(2), nodes.size());
+        assert_equal(string("selfclosed"), doc.str(doc.node(nodes.begin()[0]).tag));
+        assert_equal(string("to"), doc.str(doc.node(nodes.begin()[1]).tag));
+        assert_equal(true, doc.find_by_attribute("foo", "baz").empty());
+    });
+
+    unittest("index: repeated attribute", [] {
+        xml::Parser parser;
+        auto& doc = parser.parse("<r><a k='v' k='v'/><b k='v'/></r>");
+        assert_equal(size_t(2), doc.find_by_attribute("k", "v").size());
+    });
+
+    unittest("index: concurrent readers", [] {
+        xml::Parser parser;
+        auto& doc = parser.load("test/cd.xml");
+
+        // every thread races to build the indexes, and they all have to agree
+        vector<size_t> counts(8);
+        vector<thread> threads;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            threads.emplace_back([&doc, &counts, i] {
+                counts[i] = doc.children(doc.root(), "CD").size();
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        assert_equal(vector<size_t>(8, 26), counts);
+    });
+
+    unittest("index: concurrent attribute readers", [] {
+        xml::Parser parser;
+        auto& doc = parser.load("test/note.xml");
+
+        vector<size_t> counts(8);
+        vector<thread> threads;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            threads.emplace_back([&doc, &counts, i] {
+                counts[i] = doc.find_by_attribute("foo", "bar").size();
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        assert_equal(vector<size_t>(8, 2), counts);
+    });
+}
+
 int main(int argc, char* argv[])
 {
     for (int i = 0; i < argc; i++)
@@ -109,7 +290,11 @@ int main(int argc, char* argv[])
         cout << "argument: " << argv[i] << endl;
     }
 
-    // test_split();
+    test_split();
+    test_parser();
+    test_filter();
+    test_index();
+
     // xml::Element document;
     // try
     // {
@@ -120,6 +305,4 @@ int main(int argc, char* argv[])
     // {
     //     cout << "ERROR: " << e.what() << endl;
     // }
-
-    parse::parse_pascalish();
 }
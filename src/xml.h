@@ -9,6 +9,9 @@
 #include <map>
 #include <algorithm>
 #include <stack>
+#include <functional>
+#include <atomic>
+#include <cstring>
 
 using namespace std;
 
@@ -123,6 +126,7 @@ namespace util
 
 namespace xml
 {
+    // plain data, so any number of threads can read the same tree as long as nobody modifies it
     struct Element
     {
         string tag;
@@ -163,6 +167,72 @@ namespace xml
         }
     }
 
+    // decides which elements get built during a load
+    // called with the slash-separated tag path of each element, eg. "COLLADA/library_materials"
+    // returning false skips that element and everything inside it without allocating anything
+    typedef function<bool(const string& path)> Filter;
+
+    struct LoadOptions
+    {
+        Filter filter;
+    };
+
+    // keep only the root and the subtrees of elements with one of the given tags
+    // matching elements have to be reachable through other matches, so in practice
+    // these will be children of the root (eg. <asset> or <library_materials> in a DAE)
+    Filter include_tags(const vector<string>& tags)
+    {
+        return [tags](const string& path) {
+            // always keep the root
+            size_t start = path.find('/');
+            if (start == string::npos)
+                return true;
+
+            // check the rest of the path one tag at a time
+            while (start != string::npos)
+            {
+                start++;
+                size_t slash = path.find('/', start);
+                size_t length = (slash == string::npos ? path.length() : slash) - start;
+                for (auto& tag : tags)
+                {
+                    if (path.compare(start, length, tag) == 0)
+                        return true;
+                }
+                start = slash;
+            }
+            return false;
+        };
+    }
+
+    // drop the subtrees of elements with one of the given tags
+    Filter exclude_tags(const vector<string>& tags)
+    {
+        return [tags](const string& path) {
+            auto slash = path.rfind('/');
+            auto tag = slash == string::npos ? path : path.substr(slash + 1);
+            return find(tags.begin(), tags.end(), tag) == tags.end();
+        };
+    }
+
+    // keep only the given paths (eg. "COLLADA/library_visual_scenes/visual_scene"),
+    // their ancestors, and everything inside them
+    Filter include_paths(const vector<string>& paths)
+    {
+        return [paths](const string& path) {
+            for (auto& p : paths)
+            {
+                // one has to be a prefix of the other, ending on a tag boundary
+                auto& shorter = p.length() < path.length() ? p : path;
+                auto& longer = p.length() < path.length() ? path : p;
+                if (longer.compare(0, shorter.length(), shorter) == 0 &&
+                    (longer.length() == shorter.length() || longer[shorter.length()] == '/'))
+                    return true;
+            }
+            return false;
+        };
+    }
+
     namespace _ {
         typedef string::iterator stringit;
 
@@ -192,9 +262,418 @@ namespace xml
         {
             return search(start, end, str.begin(), str.end());
         }
+        bool starts_with(const stringit& start, const stringit& end, const string& str)
+        {
+            return size_t(end - start) >= str.length() && equal(str.begin(), str.end(), start);
+        }
+
+        // append the tag starting at 'start' (the '<') to the path and run the filter on it
+        // the caller is responsible for trimming the path back afterwards
+        bool accept(const Filter& filter, string& path, const stringit& start, const stringit& end)
+        {
+            if (!filter)
+                return true;
+
+            auto namestart = start + 1;
+            auto nameend = namestart;
+            while (nameend < end && !is_whitespace(nameend) && *nameend != '>' && *nameend != '/')
+                nameend++;
+
+            if (!path.empty())
+                path += '/';
+            path.append(namestart, nameend);
+            return filter(path);
+        }
+
+        // up to 20 characters from 'pos' for error messages, without running off the end
+        string excerpt(const stringit& pos, const stringit& end)
+        {
+            return string(pos, pos + min<ptrdiff_t>(end - pos, 20));
+        }
+
+        // if 'start' is a comment or processing instruction, return the position just after it,
+        // otherwise return 'start' unchanged
+        stringit read_misc(const stringit& start, const stringit& end)
+        {
+            const char* close = nullptr;
+            if (starts_with(start, end, "<!--"))
+                close = "-->";
+            else if (starts_with(start, end, "<?"))
+                close = "?>";
+            else
+                return start;
+
+            auto pos = read_until(start, end, close);
+            if (pos == end)
+                throw runtime_error("unterminated comment or processing instruction: " + excerpt(start, end));
+            return pos + strlen(close);
+        }
+
+        // same for a CDATA section, also returning where its content starts and ends
+        stringit read_cdata(const stringit& start, const stringit& end, stringit& content_start, stringit& content_end)
+        {
+            if (!starts_with(start, end, "<![CDATA["))
+                return start;
+
+            content_start = start + 9;
+            content_end = read_until(content_start, end, "]]>");
+            if (content_end == end)
+                throw runtime_error("unterminated CDATA section: " + excerpt(start, end));
+            return content_end + 3;
+        }
+
+        // jump over the element starting at 'start' by counting start and end tags
+        // nothing inside it is looked at beyond finding the '<' and '>' of each tag
+        stringit skip_element(const stringit& start, const stringit& end)
+        {
+            int depth = 0;
+            auto pos = start;
+            while (true)
+            {
+                pos = read_until(pos, end, '<');
+                if (pos == end)
+                    throw runtime_error("could not find close tag while skipping: " + excerpt(start, end));
+
+                // comments, CDATA and processing instructions can contain anything
+                stringit content_start, content_end;
+                auto next = read_misc(pos, end);
+                if (next == pos)
+                    next = read_cdata(pos, end, content_start, content_end);
+
+                if (next == pos)
+                {
+                    auto tag_end = read_until(pos, end, '>');
+                    if (tag_end == end)
+                        throw runtime_error("ill formed tag while skipping: " + excerpt(pos, end));
+
+                    if (*(pos+1) == '/')
+                        depth--;
+                    else if (*(tag_end-1) != '/')
+                        depth++;
+
+                    next = tag_end + 1;
+                }
+
+                pos = next;
+                if (depth == 0)
+                    return pos;
+            }
+        }
+    };
+
+    // a run of characters inside Document::source
+    struct Span
+    {
+        size_t start;
+        size_t length;
+    };
+
+    // flat counterparts of Element, linked together by index into the Document arrays
+    // everything here is trivially destructible so the arrays can be cleared in O(1)
+    struct Node
+    {
+        Span tag;
+        size_t parent;
+        size_t first_child;
+        size_t last_child;
+        size_t next_sibling;
+        size_t first_attribute;
+        size_t attribute_count;
+        size_t first_text;
+        size_t last_text;
+    };
+    struct Attribute
+    {
+        Span key;
+        Span value;
+    };
+    struct Text
+    {
+        Span text;
+        size_t next;
+    };
+
+    // a run of node indices handed out by the Document indexes
+    struct NodeRange
+    {
+        const size_t* first;
+        const size_t* last;
+
+        const size_t* begin() const { return first; }
+        const size_t* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+    };
+
+    // a parsed document produced by xml::Parser
+    // tags, attributes and text are spans into the source buffer rather than separate strings
+    // it stays valid until the Parser that owns it loads another document
+    //
+    // nothing changes it after a load, so any number of threads can read it at once
+    // (including the indexes below) as long as the Parser isn't loaded or reset meanwhile
+    class Document
+    {
+        friend class Parser;
+
+        // node indices sorted by (parent, tag, position), for children()
+        typedef vector<size_t> ChildIndex;
+
+        // attribute indices sorted by (key, value, position), and the node owning each one
+        struct AttributeIndex
+        {
+            vector<size_t> attributes;
+            vector<size_t> nodes;
+        };
+
+        string source;
+        vector<Node> nodes;
+        vector<Attribute> attributes;
+        vector<Text> texts;
+
+        // built on first use by whichever reader gets there first
+        mutable atomic<const ChildIndex*> child_index { nullptr };
+        mutable atomic<const AttributeIndex*> attribute_index { nullptr };
+
+        void clear()
+        {
+            // none of these have destructors, so this is just resetting the sizes
+            nodes.clear();
+            attributes.clear();
+            texts.clear();
+
+            // only ever called by the Parser, so nobody can be reading these
+            delete child_index.exchange(nullptr);
+            delete attribute_index.exchange(nullptr);
+        }
+
+        int compare(const Span& a, const Span& b) const
+        {
+            return source.compare(a.start, a.length, source, b.start, b.length);
+        }
+        int compare(const Span& span, const string& str) const
+        {
+            return source.compare(span.start, span.length, str);
+        }
+
+        // return the published index, or build one and try to publish it
+        // if another thread wins the race we throw ours away and use theirs
+        template<typename Index, typename Build>
+        const Index& get_index(atomic<const Index*>& slot, Build build) const
+        {
+            const Index* index = slot.load(memory_order_acquire);
+            if (index)
+                return *index;
+
+            const Index* built = new Index(build());
+            if (slot.compare_exchange_strong(index, built, memory_order_acq_rel, memory_order_acquire))
+                return *built;
+
+            delete built;
+            return *index;
+        }
+
+        const ChildIndex& get_child_index() const
+        {
+            return get_index(child_index, [this] {
+                ChildIndex index;
+                for (size_t n = 1; n < nodes.size(); n++)
+                    index.push_back(n);
+                stable_sort(index.begin(), index.end(), [this](size_t a, size_t b) {
+                    if (nodes[a].parent != nodes[b].parent)
+                        return nodes[a].parent < nodes[b].parent;
+                    return compare(nodes[a].tag, nodes[b].tag) < 0;
+                });
+                return index;
+            });
+        }
+
+        const AttributeIndex& get_attribute_index() const
+        {
+            return get_index(attribute_index, [this] {
+                AttributeIndex index;
+                for (size_t a = 0; a < attributes.size(); a++)
+                    index.attributes.push_back(a);
+                stable_sort(index.attributes.begin(), index.attributes.end(), [this](size_t a, size_t b) {
+                    int c = compare(attributes[a].key, attributes[b].key);
+                    if (c != 0)
+                        return c < 0;
+                    return compare(attributes[a].value, attributes[b].value) < 0;
+                });
+
+                // attributes are stored in node order, so the owners are just the node ranges
+                vector<size_t> owner(attributes.size());
+                for (size_t n = 0; n < nodes.size(); n++)
+                {
+                    for (size_t a = nodes[n].first_attribute; a < nodes[n].first_attribute + nodes[n].attribute_count; a++)
+                        owner[a] = n;
+                }
+                // a node repeating key="value" only gets listed once; its attributes are
+                // contiguous, so any repeats end up next to each other after the stable sort
+                size_t kept = 0;
+                for (auto a : index.attributes)
+                {
+                    if (kept > 0 && owner[a] == index.nodes.back())
+                    {
+                        auto prev = index.attributes[kept - 1];
+                        if (compare(attributes[a].key, attributes[prev].key) == 0 &&
+                            compare(attributes[a].value, attributes[prev].value) == 0)
+                            continue;
+                    }
+                    index.attributes[kept++] = a;
+                    index.nodes.push_back(owner[a]);
+                }
+                index.attributes.resize(kept);
+                return index;
+            });
+        }
+
+    public:
+        static const size_t npos = size_t(-1);
+
+        Document() {}
+        Document(const Document&) = delete;
+        Document& operator = (const Document&) = delete;
+        ~Document()
+        {
+            delete child_index.load();
+            delete attribute_index.load();
+        }
+
+        bool empty() const { return nodes.empty(); }
+        size_t size() const { return nodes.size(); }
+        size_t root() const { return nodes.empty() ? npos : 0; }
+        const Node& node(size_t n) const { return nodes[n]; }
+        const Attribute& attribute(size_t a) const { return attributes[a]; }
+        const Text& text(size_t t) const { return texts[t]; }
+
+        string str(const Span& span) const
+        {
+            return source.substr(span.start, span.length);
+        }
+        bool equals(const Span& span, const string& str) const
+        {
+            return source.compare(span.start, span.length, str) == 0;
+        }
+
+        // look up an attribute value on a node, returns false if it isn't there
+        bool find_attribute(size_t n, const string& key, string& value) const
+        {
+            auto& node = nodes[n];
+            for (size_t a = node.first_attribute; a < node.first_attribute + node.attribute_count; a++)
+            {
+                if (equals(attributes[a].key, key))
+                {
+                    value = str(attributes[a].value);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // children of a node with the given tag, in document order
+        NodeRange children(size_t n, const string& tag) const
+        {
+            auto& index = get_child_index();
+            auto first = lower_bound(index.begin(), index.end(), n, [&](size_t c, size_t) {
+                return nodes[c].parent < n || (nodes[c].parent == n && compare(nodes[c].tag, tag) < 0);
+            });
+            auto last = upper_bound(first, index.end(), n, [&](size_t, size_t c) {
+                return n < nodes[c].parent || (n == nodes[c].parent && compare(nodes[c].tag, tag) > 0);
+            });
+            return NodeRange { index.data() + (first - index.begin()), index.data() + (last - index.begin()) };
+        }
+
+        // nodes anywhere in the document with key="value", in document order, each listed once
+        NodeRange find_by_attribute(const string& key, const string& value) const
+        {
+            auto& index = get_attribute_index();
+            auto& attrs = index.attributes;
+            auto first = lower_bound(attrs.begin(), attrs.end(), 0, [&](size_t a, int) {
+                int c = compare(attributes[a].key, key);
+                return c < 0 || (c == 0 && compare(attributes[a].value, value) < 0);
+            });
+            auto last = upper_bound(first, attrs.end(), 0, [&](int, size_t a) {
+                int c = compare(attributes[a].key, key);
+                return c > 0 || (c == 0 && compare(attributes[a].value, value) > 0);
+            });
+            return NodeRange { index.nodes.data() + (first - attrs.begin()), index.nodes.data() + (last - attrs.begin()) };
+        }
+
+        // copy a subtree out into the regular Element form
+        void to_element(size_t n, Element& elem) const
+        {
+            auto& node = nodes[n];
+            elem.tag = str(node.tag);
+            for (size_t a = node.first_attribute; a < node.first_attribute + node.attribute_count; a++)
+            {
+                elem.attributes[str(attributes[a].key)] = str(attributes[a].value);
+            }
+            for (size_t t = node.first_text; t != npos; t = texts[t].next)
+            {
+                elem.text.push_back(str(texts[t].text));
+            }
+            for (size_t c = node.first_child; c != npos; c = nodes[c].next_sibling)
+            {
+                elem.children.emplace_back();
+                to_element(c, elem.children.back());
+            }
+        }
+    };
 
-        stringit read_attributes(const stringit& start, const stringit& end, Element& elem)
+    // reusable parser for loading many documents in a row
+    // the source buffer and node arrays keep their capacity between loads, so once they
+    // have grown to fit the biggest document parsing doesn't allocate any more
+    class Parser
+    {
+        typedef _::stringit stringit;
+        static const size_t npos = Document::npos;
+
+        Document doc;
+        const Filter* filter = nullptr;
+        string path;
+
+        Span span(const stringit& start, const stringit& end)
         {
+            return Span { size_t(start - doc.source.begin()), size_t(end - start) };
+        }
+
+        size_t add_node(size_t parent)
+        {
+            size_t n = doc.nodes.size();
+            doc.nodes.push_back(Node {
+                Span { 0, 0 }, parent,
+                npos, npos, npos,
+                doc.attributes.size(), 0,
+                npos, npos
+            });
+            if (parent != npos)
+            {
+                auto& p = doc.nodes[parent];
+                if (p.last_child == npos)
+                    p.first_child = n;
+                else
+                    doc.nodes[p.last_child].next_sibling = n;
+                p.last_child = n;
+            }
+            return n;
+        }
+
+        void add_text(size_t n, const stringit& start, const stringit& end)
+        {
+            size_t t = doc.texts.size();
+            doc.texts.push_back(Text { span(start, end), npos });
+            auto& node = doc.nodes[n];
+            if (node.last_text == npos)
+                node.first_text = t;
+            else
+                doc.texts[node.last_text].next = t;
+            node.last_text = t;
+        }
+
+        void read_attributes(const stringit& start, const stringit& end, size_t n)
+        {
+            using namespace xml::_;
+
             auto pos = start;
             while (true)
             {
@@ -207,51 +686,50 @@ namespace xml
                 auto key_start = pos;
                 auto key_end = read_until(key_start, end, '=');
                 if (key_end == end)
-                    throw runtime_error("malformed attribute: " + string(pos, pos+20));
+                    throw runtime_error("malformed attribute: " + excerpt(pos, end));
 
                 // read an attribute value
                 auto val_start = key_end + 1;
                 char quotechar = *val_start;
                 if (quotechar != '"' && quotechar != '\'')
-                    throw runtime_error("malformed attribute: " + string(pos, pos+20));
+                    throw runtime_error("malformed attribute: " + excerpt(pos, end));
                 auto val_end = read_until(val_start+1, end, quotechar);
                 if (val_end == end)
-                    throw runtime_error("malformed attribute: " + string(pos, pos+20));
+                    throw runtime_error("malformed attribute: " + excerpt(pos, end));
 
-                // add to the element's attribute list
-                elem.attributes[string(key_start, key_end)] = string(val_start+1, val_end);
+                // add to the node's attribute range
+                doc.attributes.push_back(Attribute { span(key_start, key_end), span(val_start+1, val_end) });
+                doc.nodes[n].attribute_count++;
 
                 pos = val_end + 1;
             }
         }
 
-        stringit read_element(const stringit& start, const stringit& end, Element& elem)
+        stringit read_element(const stringit& start, const stringit& end, size_t parent)
         {
+            using namespace xml::_;
+
             // find the end of the opening tag
             auto start_tag_start = start;
             auto start_tag_end = read_until(start_tag_start+1, end, '>');
             if (start_tag_end == end)
-                throw runtime_error("ill formed start tag: " + string(start_tag_start, start_tag_start+20));
+                throw runtime_error("ill formed start tag: " + excerpt(start_tag_start, end));
             bool selfclosed = (*(start_tag_end-1) == '/');
             start_tag_end -= selfclosed ? 1 : 0;
 
-
             // extract the tag name
+            size_t n = add_node(parent);
             auto namestart = start_tag_start + 1;
             auto nameend = read_until_whitespace(namestart, start_tag_end);
-            elem.tag = string(namestart, nameend);
-
+            doc.nodes[n].tag = span(namestart, nameend);
 
             // parse attributes
-            auto attrs_start = nameend;
-            auto attrs_end = start_tag_end;
-            read_attributes(attrs_start, start_tag_end, elem);
+            read_attributes(nameend, start_tag_end, n);
 
             // if it's a self-closed element, we're done
             if (selfclosed)
                 return start_tag_end+2;
 
-
             // start reading content
             stringit pos = start_tag_end + 1;
             while (pos < end)
@@ -261,73 +739,153 @@ namespace xml
                 if (*pos == '<' && *(pos+1) == '/')
                 {
                     // close tag
-                    auto close_tag_start = pos;
                     auto close_tag_end = read_until(pos, end, '>');
                     if (close_tag_end == end)
-                        throw runtime_error("malformed close tag" + string(close_tag_start, close_tag_start+20));
-                    // break;
+                        throw runtime_error("malformed close tag" + excerpt(pos, end));
                     return close_tag_end+1;
                 }
+                else if (starts_with(pos, end, "<!--") || starts_with(pos, end, "<?"))
+                {
+                    // comment or processing instruction, nothing to keep
+                    pos = read_misc(pos, end);
+                }
+                else if (starts_with(pos, end, "<![CDATA["))
+                {
+                    // CDATA section, keep the content as text
+                    stringit content_start, content_end;
+                    pos = read_cdata(pos, end, content_start, content_end);
+                    add_text(n, content_start, content_end);
+                }
                 else if (*pos == '<')
                 {
                     // child element
-                    Element child;
-                    pos = read_element(pos, end, child);
-                    elem.children.push_back(child);
+                    auto mark = path.length();
+                    if (accept(*filter, path, pos, end))
+                        pos = read_element(pos, end, n);
+                    else
+                        pos = skip_element(pos, end);
+                    path.resize(mark);
                 }
                 else
                 {
                     // read text
-                    // FUCK COMMENTS >:)
                     auto text_end = read_until(pos, end, '<');
                     if (text_end == end)
                         throw runtime_error("could not find end of text content ('<' for end-tag or a child element start-tag)");
 
-                    elem.text.push_back(string(pos, text_end));
+                    add_text(n, pos, text_end);
                     pos = text_end;
                 }
             }
             throw runtime_error("could not find close tag" + string(start_tag_start, start_tag_end+1));
         }
-    };
 
-    void load(const string& fname, Element& document)
-    {
-        using namespace xml::_;
+        const Document& parse_source(const LoadOptions& options)
+        {
+            using namespace xml::_;
 
-        string source = util::read_text_file(fname);
-        if (source.length() < 1)
+            auto& source = doc.source;
+            if (source.length() < 1)
+                throw runtime_error("empty document");
+
+            stringit it = source.begin();
+            if (source[0] == '<' && source[1] == '?')
+            {
+                it += 5; // skip "<?xml"
+                stringit declend = read_until(it, source.end(), "?>");
+                if (declend == source.end())
+                    throw runtime_error("broken xml declaration (found '<?' but not '?>'");
+                it = declend+2;
+            }
+
+            // skip whitespace, comments and processing instructions until the root element
+            while (true)
+            {
+                it = read_whitespace(it, source.end());
+                auto next = read_misc(it, source.end());
+                if (next == it)
+                    break;
+                it = next;
+            }
+            if (*it != '<')
+                throw runtime_error("could not find root element");
+
+            filter = &options.filter;
+            path.clear();
+            if (accept(*filter, path, it, source.end()))
+                read_element(it, source.end(), npos);
+            return doc;
+        }
+
+        // parse whatever is in the source buffer, making sure a failed parse
+        // doesn't leave half a document behind
+        const Document& parse_checked(const LoadOptions& options)
         {
-            throw runtime_error("could not open file " + fname);
+            try
+            {
+                return parse_source(options);
+            }
+            catch (...)
+            {
+                reset();
+                throw;
+            }
         }
 
-        stringit it = source.begin();
+    public:
+        const Document& document() const { return doc; }
+
+        // forget the current document but keep all the capacity around for the next one
+        void reset()
+        {
+            doc.clear();
+            doc.source.clear();
+        }
 
-        // check for XML-declaration
-        if (source[0] == '<' && source[1] == '?')
+        const Document& load(const string& fname, const LoadOptions& options = LoadOptions())
         {
-            it += 5; // skip "<?xml"
-            stringit declend = read_until(it, source.end(), "?>");
-            if (declend == source.end())
+            reset();
+
+            // read straight into the existing buffer instead of building a new string
+            std::ifstream file(fname, std::ios::binary);
+            if (!file)
+                throw runtime_error("could not open file " + fname);
+            file.seekg(0, std::ios::end);
+            auto length = file.tellg();
+            file.seekg(0, std::ios::beg);
+            if (length < 1)
+                throw runtime_error("could not open file " + fname);
+            doc.source.resize(size_t(length));
+            if (!file.read(&doc.source[0], length))
             {
-                throw runtime_error("broken xml declaration (found '<?' but not '?>'");
+                reset();
+                throw runtime_error("could not read file " + fname);
             }
 
-            it = declend+2;
+            return parse_checked(options);
         }
 
-        // skip whitespace until the root element
-        it = read_whitespace(it, source.end());
-        if (*it != '<')
+        const Document& parse(const string& source, const LoadOptions& options = LoadOptions())
         {
-            throw runtime_error("could not find root element");
+            reset();
+            doc.source.assign(source);
+            return parse_checked(options);
         }
+    };
+
+    // one-off load into an Element tree
+    // the root element ends up as the only child of 'document'
+    void load(const string& fname, Element& document, const LoadOptions& options = LoadOptions())
+    {
+        Parser parser;
+        auto& doc = parser.load(fname, options);
+
+        // the filter might have thrown out the whole thing
+        if (doc.empty())
+            return;
 
-        // read the root element
-        Element root;
-        read_element(it, source.end(), root);
-        document.children.push_back(root);
-        // ignore any trailing comments/processing instructions
+        document.children.emplace_back();
+        doc.to_element(doc.root(), document.children.back());
     }
 };
 